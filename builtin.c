@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/select.h>
+#include "builtin.h"
+#include "prompt.h"
+
+extern job *first_job;
+
+job *find_job_id(int id);
+int job_is_completed(job *j);
+int job_is_stopped(job *j);
+void update_status();
+void remove_job(job *j);
+void drain_job_output(job *j);
+
+/* cd - Change the working directory, defaulting to $HOME */
+static int builtin_cd(int argc, char **argv)
+{
+    const char *dir = argc > 1 ? argv[1] : getenv("HOME");
+    if(!dir) {
+        fprintf(stderr, "cd: HOME not set\n");
+        return 1;
+    }
+    if(chdir(dir) < 0) {
+        fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    prompt_cwd_changed();
+    return 0;
+}
+
+/* memstats - Report live and pooled job, process and argument memory */
+static int builtin_memstats(int argc, char **argv)
+{
+    print_memstats();
+    return 0;
+}
+
+/* How often jobs --follow rechecks the job while it is quiet */
+#define FOLLOW_POLL_MS 250
+
+/* Set by SIGINT to end jobs --follow */
+static volatile sig_atomic_t follow_interrupted;
+
+static void interrupt_follow(int signum)
+{
+    follow_interrupted = 1;
+}
+
+/* Print the output captured for job j, the last tail lines only if tail > 0.
+ *  With follow, keep printing new output until the job finishes or closes
+ *  its output, or until Ctrl-C returns to the prompt.
+ *  A finished job is released once its output has been read.
+ */
+static int print_job_output(job *j, int tail, int follow)
+{
+    unsigned long long from;
+    fd_set fds;
+    struct timeval timeout;
+    struct sigaction action, saved_action;
+
+    drain_job_output(j);
+    from = tail > 0 ? ring_tail(j->output, tail) : ring_oldest(j->output);
+    if(tail <= 0 && from > 0) {
+        fprintf(stderr, "jobs: [%d] %llu bytes of earlier output dropped\n", j->id, from);
+    }
+    from = ring_write_out(j->output, from, STDOUT_FILENO);
+
+    if(follow) {
+        /* Ctrl-C ends the follow instead of reaching the shell's own handler */
+        follow_interrupted = 0;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = interrupt_follow;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, &saved_action);
+    }
+
+    while(follow && j->output_fd >= 0 && !follow_interrupted) {
+        FD_ZERO(&fds);
+        FD_SET(j->output_fd, &fds);
+        timeout.tv_sec = 0;
+        timeout.tv_usec = FOLLOW_POLL_MS * 1000;
+        if(select(j->output_fd + 1, &fds, NULL, NULL, &timeout) < 0 && errno != EINTR) {
+            perror("select");
+            break;
+        }
+        drain_job_output(j);
+        from = ring_write_out(j->output, from, STDOUT_FILENO);
+
+        /* Stop once the job is reaped, even if something still holds the pipe */
+        update_status();
+        if(job_is_completed(j)) {
+            drain_job_output(j);
+            from = ring_write_out(j->output, from, STDOUT_FILENO);
+            break;
+        }
+    }
+
+    if(follow) {
+        sigaction(SIGINT, &saved_action, NULL);
+        if(follow_interrupted) printf("\n");
+    }
+
+    update_status();
+    if(job_is_completed(j) && j->output_fd < 0) remove_job(j);
+    return 0;
+}
+
+/* jobs [-o %n [--tail N|--follow]] - List jobs, or print a job's captured output */
+static int builtin_jobs(int argc, char **argv)
+{
+    job *j;
+    int k, id = 0, tail = 0, follow = 0, output = 0;
+    char *end;
+
+    for(k = 1; k < argc; k++) {
+        if(strcmp(argv[k], "-o") == 0 && k + 1 < argc) {
+            const char *spec = argv[++k];
+            if(*spec == '%') spec++;
+            id = strtol(spec, &end, 10);
+            if(*spec == '\0' || *end != '\0') goto usage;
+            output = 1;
+        } else if(strcmp(argv[k], "--tail") == 0 && k + 1 < argc) {
+            tail = strtol(argv[++k], &end, 10);
+            if(tail <= 0 || *end != '\0') goto usage;
+        } else if(strcmp(argv[k], "--follow") == 0) {
+            follow = 1;
+        } else goto usage;
+    }
+    if((tail || follow) && !output) goto usage;
+
+    if(output) {
+        if(!(j = find_job_id(id))) {
+            fprintf(stderr, "jobs: %%%d: no such job\n", id);
+            return 1;
+        }
+        if(!j->output) {
+            fprintf(stderr, "jobs: %%%d: output was not captured\n", id);
+            return 1;
+        }
+        return print_job_output(j, tail, follow);
+    }
+
+    update_status();
+    for(j = first_job; j; j = j->next) {
+        const char *state = job_is_completed(j) ? "completed" :
+                            job_is_stopped(j) ? "stopped" : "running";
+        printf("[%d] %ld %-9s %s%s\n", j->id, (long)j->pgid, state, j->command,
+                j->output ? " (output captured)" : "");
+    }
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: jobs [-o %%n [--tail N|--follow]]\n");
+    return 2;
+}
+
+static const builtin builtins[] = {
+    { "cd", builtin_cd },
+    { "jobs", builtin_jobs },
+    { "memstats", builtin_memstats },
+    { NULL, NULL }
+};
+
+static const builtin *find_builtin(const char *name)
+{
+    const builtin *b;
+    for(b = builtins; b->name; b++) {
+        if(strcmp(b->name, name) == 0) return b;
+    }
+    return NULL;
+}
+
+/* Returns 1 iff p names a builtin */
+int is_builtin(process *p)
+{
+    return find_builtin(p->argv[0]) != NULL;
+}
+
+/* Run the single process of job j in the shell if it names a builtin.
+ *  The job's IO channels are installed over the shell's own for the
+ *  duration of the builtin and restored afterwards.
+ *  Returns the builtin's exit status, or -1 if it is not a builtin.
+ */
+int run_builtin(job *j)
+{
+    process *p = j->first_process;
+    const builtin *b = find_builtin(p->argv[0]);
+    int channels[3] = { j->stdin, j->stdout, j->stderr };
+    int saved[3] = { -1, -1, -1 };
+    int k;
+
+    if(!b) return -1;
+
+    /* A redirect that failed to open has already been reported */
+    for(k = 0; k < 3; k++) {
+        if(channels[k] < 0) return 1;
+    }
+
+    fflush(stdout);
+    for(k = 0; k < 3; k++) {
+        if(channels[k] == k) continue;
+        saved[k] = fcntl(k, F_DUPFD_CLOEXEC, 0);
+        dup2(channels[k], k);
+    }
+
+    p->status = b->run(p->argc, p->argv);
+    p->completed = 1;
+
+    fflush(stdout);
+    for(k = 0; k < 3; k++) {
+        if(saved[k] < 0) continue;
+        dup2(saved[k], k);
+        close(saved[k]);
+    }
+    return p->status;
+}
@@ -0,0 +1,17 @@
+#ifndef _builtin_h
+#define _builtin_h
+
+#include "job.h"
+
+/* Builtin structure - A command run inside the shell process */
+typedef struct builtin builtin;
+struct builtin {
+    const char *name;               // Command name
+    int (*run)(int argc, char **argv);  // Returns the exit status
+};
+
+int is_builtin(process *p);
+
+int run_builtin(job *j);
+
+#endif
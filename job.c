@@ -3,12 +3,68 @@
 #include <sys/types.h>
 #include <termios.h>
 #include <unistd.h>
+#include <string.h>
 #include "job.h"
 
+#define SLAB_OBJECTS 64
+
+/* Slab pool - Fixed-size objects carved out of slabs.
+ *  Released objects go onto a free list and are reused before a new slab
+ *  is allocated, so the pool only grows to the peak number of live objects.
+ */
+typedef struct pool pool;
+struct pool {
+    const char *name;               // Name shown by memstats
+    size_t object_size;             // Size of each object
+    void *free_list;                // Free objects, linked through their first word
+    size_t live;                    // Objects handed out
+    size_t pooled;                  // Objects on the free list
+    size_t slabs;                   // Slabs allocated
+};
+
+static pool job_pool = { "jobs", sizeof(job), NULL, 0, 0, 0 };
+static pool process_pool = { "processes", sizeof(process), NULL, 0, 0, 0 };
+
+/* Live argument strings and the bytes held by them and their argv vectors */
+static size_t args_live = 0;
+static size_t arg_bytes_live = 0;
+
+static void *pool_alloc(pool *pl)
+{
+    char *obj;
+    if(!pl->free_list) {
+        char *slab = malloc(pl->object_size * SLAB_OBJECTS);
+        int k;
+        if(!slab) return NULL;
+        for(k = 0; k < SLAB_OBJECTS; k++) {
+            obj = slab + k * pl->object_size;
+            *(void **)obj = pl->free_list;
+            pl->free_list = obj;
+        }
+        pl->slabs++;
+        pl->pooled += SLAB_OBJECTS;
+    }
+    obj = pl->free_list;
+    pl->free_list = *(void **)obj;
+    pl->pooled--;
+    pl->live++;
+    return obj;
+}
+
+static void pool_free(pool *pl, void *obj)
+{
+    *(void **)obj = pl->free_list;
+    pl->free_list = obj;
+    pl->pooled++;
+    pl->live--;
+}
+
 job *new_job()
 {
-    job *j = malloc(sizeof(job));
+    job *j = pool_alloc(&job_pool);
+    if(!j) return NULL;
     j->next = NULL;
+    j->id = 0;
     j->command = NULL;
     j->first_process = NULL;
     j->pgid = 0;
@@ -16,20 +72,81 @@ job *new_job()
     j->stdin = STDIN_FILENO;
     j->stdout = STDOUT_FILENO;
     j->stderr = STDERR_FILENO;
+    j->output = NULL;
+    j->output_fd = -1;
     return j;
 }
 
 process *new_process()
 {
-    process *p = malloc(sizeof(process));
+    process *p = pool_alloc(&process_pool);
+    if(!p) return NULL;
     p->next = NULL;
     p->pid = 0;
     p->completed = 0;
     p->stopped = 0;
     p->status = 0;
+    p->argc = 0;
+    p->argv_size = 0;
+    p->argv = NULL;
     return p;
 }
 
+/* Release the process p, its arguments and argv back to the pool */
+void delete_process(process *p)
+{
+    int k;
+    for(k = 0; k < p->argc; k++) {
+        arg_bytes_live -= strlen(p->argv[k]) + 1;
+        free(p->argv[k]);
+    }
+    args_live -= p->argc;
+    arg_bytes_live -= sizeof(char *) * p->argv_size;
+    free(p->argv);
+    pool_free(&process_pool, p);
+}
+
+/* Release the job j, its processes, redirect fds and captured output.
+ *  Does not signal or wait for any processes.
+ */
+void delete_job(job *j)
+{
+    process *p, *next;
+    for(p = j->first_process; p; p = next) {
+        next = p->next;
+        delete_process(p);
+    }
+    if(j->stdin > STDERR_FILENO) close(j->stdin);
+    if(j->stdout > STDERR_FILENO) close(j->stdout);
+    if(j->stderr > STDERR_FILENO) close(j->stderr);
+    if(j->output_fd >= 0) close(j->output_fd);
+    if(j->output) ring_free(j->output);
+    pool_free(&job_pool, j);
+}
+
+/* Append a copy of the first len characters of arg to the arguments of p.
+ *  argv grows geometrically and is kept NULL-terminated.
+ *  Returns 0 on success and -1 if out of memory.
+ */
+int process_add_arg(process *p, const char *arg, size_t len)
+{
+    if(p->argc + 1 >= p->argv_size) {
+        int size = p->argv_size ? p->argv_size * 2 : 8;
+        char **argv = realloc(p->argv, sizeof(char *) * size);
+        if(!argv) return -1;
+        arg_bytes_live += sizeof(char *) * (size - p->argv_size);
+        p->argv = argv;
+        p->argv_size = size;
+    }
+    char *copy = strndup(arg, len);
+    if(!copy) return -1;
+    p->argv[p->argc++] = copy;
+    p->argv[p->argc] = NULL;
+    args_live++;
+    arg_bytes_live += strlen(copy) + 1;
+    return 0;
+}
+
 void print_process(process *p)
 {
     printf("Process (%d):\nargc: %d\n", p->pid, p->argc);
@@ -38,3 +155,18 @@ void print_process(process *p)
         printf("argv[%d]: %s\n", i, p->argv[i]);
     }
 }
+
+static void print_pool(pool *pl)
+{
+    printf("%-10s %8zu live %8zu pooled %10zu bytes in %zu slabs\n",
+            pl->name, pl->live, pl->pooled,
+            pl->slabs * SLAB_OBJECTS * pl->object_size, pl->slabs);
+}
+
+/* Print live and pooled object counts for the memstats builtin */
+void print_memstats()
+{
+    print_pool(&job_pool);
+    print_pool(&process_pool);
+    printf("%-10s %8zu live %10zu bytes\n", "arguments", args_live, arg_bytes_live);
+}
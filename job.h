@@ -4,6 +4,7 @@
 #include <sys/types.h>
 #include <termios.h>
 #include <unistd.h>
+#include "ring.h"
 
 /* Process structure - An individual process of computation */
 typedef struct process process;
@@ -14,7 +15,8 @@ struct process {
     char stopped;                   // True if process is stopped
     int status;                     // Status flags
     int argc;                       // Number of arguments
-    char **argv;                    // Arguments for execution
+    int argv_size;                  // Allocated slots in argv
+    char **argv;                    // NULL-terminated arguments for execution
 };
 
 
@@ -23,16 +25,27 @@ struct process {
 typedef struct job job;
 struct job {
     job *next;                      // Next active job
+    int id;                         // Job number shown to the user
     char *command;                  // Command Line
     process *first_process;         // Pointer to process list for job
     pid_t pgid;                     // Process group ID
     char notified;                  // True if user told about a stopped job
     struct termios tmodes;          // Terminal modes
     int stdin, stdout, stderr;      // IO channels
+    ring *output;                   // Captured output, NULL if not captured
+    int output_fd;                  // Read end of the capture pipe, -1 once closed
 };
 
 job *new_job();
 
 process *new_process();
 
+void delete_job(job *j);
+
+void delete_process(process *p);
+
+int process_add_arg(process *p, const char *arg, size_t len);
+
+void print_memstats();
+
 #endif
@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <signal.h>
+#include <errno.h>
+#include <sys/select.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,20 +11,30 @@
 #include "parser.h"
 #include "scanner.yy.h"
 #include "job.h"
+#include "tokenizer.h"
+#include "builtin.h"
+#include "prompt.h"
 
 #define MAX_HISTORY 1 << 8
-#define MAX_SIZE 1 << 16
-#define MAX_ARGUMENTS 1 << 8
-#define MAX_COMMANDS 1 << 8
 
 void *ParseAlloc(void* (*allocProc)(size_t));
 void Parse(void* parser, int token, const char* in, int* val);
 void ParseFree(void* parser, void(*freeProc)(void*));
 
-char *getcwd(char *buf, size_t size);
-
 extern job *first_job;
-job *current_job;
+
+void add_job(job *j);
+void remove_job(job *j);
+int job_is_completed(job *j);
+int job_exit_status(job *j);
+int open_here_document(const char *text, size_t len);
+int job_fits_arg_max(job *j);
+void do_job_notification();
+int capture_fd_set(fd_set *fds, int max_fd);
+void drain_captured_output(fd_set *fds);
+
+/* Use the vectorized tokenizer in place of the flex scanner */
+int fast_tokenizer = 0;
 
 void print_lexCode(int debug, int lexCode)
 {
@@ -50,15 +62,6 @@ if(debug == 0) return;
     }
 }
 
-/* Print the cwd to the command line */
-void print_cwd()
-{
-    char cwd[1024];
-    if( getcwd(cwd, sizeof(cwd)) != NULL) {
-        printf("%s", cwd);
-    }
-}
-
 /* Safely copies n characters from src to dst, ensuring that dst is null-terminated. */
 char *sstrcpy(char *dst, const char *src, size_t n)
 {
@@ -71,181 +74,273 @@ char *sstrcpy(char *dst, const char *src, size_t n)
 }
 
 /* Parse the command line.
+ *  Arguments are appended to growable argv vectors as they are lexed, so
+ *  there is no limit on the number of tokens or pipeline stages.
+ *  here_body is the body of a here-document on the line, if known.
  *  Returns 0 on success and -1 on a syntax error.
+ *  Returns 1 without running anything if the line has a here-document and
+ *  here_body is NULL; *here_delim is then set to its delimiter.
  */
-int parse(char *cmd_line, int debug)
+int parse(char *cmd_line, const char *here_body, char **here_delim, int debug)
 {
-    int num_tokens;
-    num_tokens = 0;
-    char *token[MAX_COMMANDS];
     int foreground = 1;
+    int capture = 0;
 
     // Set up the lexer
-    yyscan_t lexer;
-    yylex_init(&lexer);
-    YY_BUFFER_STATE bufferState = yy_scan_string(cmd_line, lexer);
+    yyscan_t lexer = NULL;
+    YY_BUFFER_STATE bufferState = NULL;
+    tokenizer tok;
+    token_span span;
+    const char *text;
+    size_t text_len;
+    if(fast_tokenizer) tokenizer_init(&tok, cmd_line);
+    else {
+        yylex_init(&lexer);
+        bufferState = yy_scan_string(cmd_line, lexer);
+    }
 
     // Set up the parser
     void *parser = ParseAlloc(malloc);
 
     int validParse;
     int lexCode;
-    int i,j;
-    int proc_marker, num_processes;
-    int infile_marker, outfile_marker;
-    char *proc_argv[MAX_ARGUMENTS][MAX_COMMANDS];
-    int proc_argc[MAX_COMMANDS];
-    i = 0;
-    j = 0;
-    infile_marker = -1;
-    outfile_marker = -1;
-    proc_marker = 0;
-    num_processes = 0;
+    int status;
+    int builtin_job;
+    job *j = new_job();
+    process **last_process = j ? &j->first_process : NULL;
+    process *p = NULL;
+    char *infile_name = NULL;
+    char *outfile_name = NULL;
+    char *here_string = NULL;
+    char *here_doc = NULL;
+    // Set when the next token names a redirect target rather than an argument
+    char **redirect_name = NULL;
+    check_mem(j);
     do {
-        lexCode = yylex(lexer);
+        if(fast_tokenizer) {
+            lexCode = tokenizer_next(&tok, &span);
+            text = cmd_line + span.offset;
+            text_len = span.length;
+        } else {
+            lexCode = yylex(lexer);
+            text = yyget_text(lexer);
+            text_len = yyget_leng(lexer);
+        }
         validParse = 1;
         Parse(parser, lexCode, NULL, &validParse);
 
         if(!validParse || lexCode == -1) goto error;
 
-        if(num_tokens++ == MAX_COMMANDS) goto error;
-
         if(lexCode == BACKGROUND) foreground = 0;
-        else if(lexCode == REDIRECT_IN) { 
-            infile_marker = i;
+        else if(lexCode == BACKGROUND_CAPTURE) {
+            foreground = 0;
+            capture = 1;
         }
-        else if(lexCode == REDIRECT_OUT) {
-            outfile_marker = i;
+        else if(lexCode == REDIRECT_IN) redirect_name = &infile_name;
+        else if(lexCode == REDIRECT_OUT) redirect_name = &outfile_name;
+        else if(lexCode == HERE_STRING) redirect_name = &here_string;
+        else if(lexCode == HERE_DOC) {
+            // The token is "<<" followed by the delimiter
+            text += 2;
+            text_len -= 2;
+            while(*text == ' ' || *text == '\t') {
+                text++;
+                text_len--;
+            }
+            here_doc = strndup(text, text_len);
+            check_mem(here_doc);
         }
         else if(lexCode == 0 || lexCode == PIPE) {
-            if(i == 0) break;
-            // This is a pipe or endline, so accumulate the tokens up to this point
-            //  as the arguments to a single process.
-            int pos = 0;
-            for(j = proc_marker; j < i; j++) {
-                // Clone in each token into the processes' argv
-                // As long as the token is not associated with a file redirect
-                if(j != infile_marker && j != outfile_marker) {
-                    int len = strlen(token[j]);
-                    proc_argv[num_processes][pos] = malloc(sizeof(char) * (len + 1));
-                    sstrcpy(proc_argv[num_processes][pos++], token[j], len); 
-                }
-            }
-            proc_argc[num_processes] = i - proc_marker;
-            if(infile_marker > 0) proc_argc[num_processes]--;
-            if(outfile_marker > 0) proc_argc[num_processes]--;
-            // Increment the process count
-            num_processes++;
-            // The next process' arguments will start at token i
-            proc_marker = i;
-        // Any other tokens that are not already designated as IO 
+            // This is a pipe or endline, so the next argument starts a new process
+            p = NULL;
+        } else if(redirect_name) {
+            *redirect_name = strndup(text, text_len);
+            check_mem(*redirect_name);
+            redirect_name = NULL;
         } else {
-            // Clone the token
-            int len = strlen(yyget_text(lexer));
-            token[i] = calloc(sizeof(char) * (len + 1), sizeof(char));
-            sstrcpy(token[i++], yyget_text(lexer), len);
+            if(!p) {
+                p = new_process();
+                check_mem(p);
+                *last_process = p;
+                last_process = &p->next;
+            }
+            check_mem(process_add_arg(p, text, text_len) == 0);
         }
 
     } while(lexCode > 0);
 
-    char *infile_name;
-    char *outfile_name;
+    if(j->first_process == NULL) goto error;
 
-    if(infile_marker > 0) {
-        int len = strlen(token[infile_marker]);
-        infile_name = (char*)malloc(sizeof(char) * (len+1));
-        sstrcpy(infile_name, token[infile_marker], len);
+    // The caller collects the here-document body and parses the line again
+    if(here_doc && !here_body && here_delim) {
+        *here_delim = here_doc;
+        here_doc = NULL;
+        delete_job(j);
+        status = 1;
+        goto done;
     }
 
-    if(outfile_marker > 0) {
-        int len = strlen(token[outfile_marker]);
-        outfile_name = (char*)malloc(sizeof(char) * (len+1));
-        sstrcpy(outfile_name, token[outfile_marker], len);
-    }
-
-    if(num_processes == 0) goto error;
-
-    int k,l;
-    // Wipe the token buffer
-    for(k = 0; k < i; k++) {
-        l = 0;
-        while(token[k][l] != '\0') token[k][l++] = '\0';
-        if(token[k]) free(token[k]);
-    }
-
-    if(!current_job) current_job = new_job();
-
-    // Initialize a job with the processes
-    if(current_job->first_process == NULL) current_job->first_process = new_process();
-    process *p = current_job->first_process;
-
-    // Initialize all processes
-    for(k = 0; k < num_processes; k++) {
-        p->argc = proc_argc[k];
-        p->argv = (char**)malloc(sizeof(char *) * MAX_ARGUMENTS);
-        for(j = 0; j < proc_argc[k]; j++) {
-            // Clone in each token
-            int len = strlen(proc_argv[k][j]);
-            p->argv[j] = calloc(sizeof(char) * (len + 1), sizeof(char));
-            sstrcpy(p->argv[j], proc_argv[k][j], len);
-            // Deallocate the memory associated with the old buffer
-            while(proc_argv[k][j][l] != '\0') proc_argv[k][j][l++] = '\0';
-            if(proc_argv[k][j]) free(proc_argv[k][j]);
+    j->command = j->first_process->argv[0];
+
+    builtin_job = !j->first_process->next && is_builtin(j->first_process);
+
+    if(builtin_job && !foreground) {
+        fprintf(stderr, "%s: builtins cannot run in the background\n", j->command);
+        prompt_set_status(1);
+        delete_job(j);
+    } else if(!builtin_job && !job_fits_arg_max(j)) {
+        // Refused before any redirect is opened, with the status of a failed exec
+        prompt_set_status(126);
+        delete_job(j);
+    } else {
+        // Set IO as needed
+        if(infile_name) {
+            j->stdin = open(infile_name, O_RDONLY);
+            if(j->stdin < 0) perror(infile_name);
+        } else if(here_string) {
+            // Like other shells, a here-string is followed by a newline
+            size_t len = strlen(here_string);
+            here_string[len] = '\n';
+            j->stdin = open_here_document(here_string, len + 1);
+            here_string[len] = '\0';
+        } else if(here_doc) {
+            j->stdin = open_here_document(here_body ? here_body : "",
+                            here_body ? strlen(here_body) : 0);
         }
-
-        if(k < num_processes - 1) {
-            p->next = new_process();
-            p = p->next;
+        if(outfile_name) {
+            j->stdout = open(outfile_name, O_WRONLY | O_CREAT, 
+                            S_IWUSR | S_IRUSR | S_IRGRP | S_IWGRP);
+            if(j->stdout < 0) perror(outfile_name);
         }
-    }
 
-    // Set IO as needed
-    if(infile_marker > 0) { 
-        current_job->stdin = open(infile_name, O_RDONLY);
-        free(infile_name);
-        infile_marker = -1;
-    }
-    if(outfile_marker > 0) {
-        current_job->stdout = open(outfile_name, O_WRONLY | O_CREAT, 
-                        S_IWUSR | S_IRUSR | S_IRGRP | S_IWGRP);
-        free(outfile_name);
-        outfile_marker = -1;
+        if(j->stdin < 0 || j->stdout < 0 || j->stderr < 0) {
+            // A redirect or here-document failed and has been reported
+            prompt_set_status(1);
+            delete_job(j);
+        } else if(builtin_job) {
+            // Builtins run inside the shell with the job's IO channels
+            prompt_set_status(run_builtin(j));
+            delete_job(j);
+        } else {
+            add_job(j);
+            launch_job(j, foreground, capture, debug);
+            // Finished foreground jobs are reclaimed without being reported
+            if(foreground && job_is_completed(j)) {
+                prompt_set_status(job_exit_status(j));
+                remove_job(j);
+            }
+        }
     }
+    status = 0;
 
-    current_job->command = current_job->first_process->argv[0];
-    launch_job(current_job, foreground, debug);
+done:
+    free(infile_name);
+    free(outfile_name);
+    free(here_string);
+    free(here_doc);
 
-    current_job = current_job->next;
-
-    yy_delete_buffer(bufferState, lexer);
-    yylex_destroy(lexer);
+    if(!fast_tokenizer) {
+        yy_delete_buffer(bufferState, lexer);
+        yylex_destroy(lexer);
+    }
     ParseFree(parser, free);
-    return 0;
+    return status;
 
 error:
-    // Wipe the token buffer
-    for(k = 0; k < i; k++) {
-        l = 0;
-        while(token[k][l] != '\0') token[k][l++] = '\0';
-        if(token[k]) free(token[k]);
+    if(j) delete_job(j);
+    free(infile_name);
+    free(outfile_name);
+    free(here_string);
+    free(here_doc);
+
+    if(!fast_tokenizer) {
+        yy_delete_buffer(bufferState, lexer);
+        yylex_destroy(lexer);
     }
-    // Wipe each argument buffer
-    for(k = 0; k < num_processes; k++) {
-        int r;
-        for(r = 0; r < proc_argc[k]; r++) {
-            l = 0;
-            while(proc_argv[k][r][l] != '\0') proc_argv[k][r][l++] = '\0';
-            if(proc_argv[k][r]) free(proc_argv[k][r]);
-        } 
-    }
-
-    yy_delete_buffer(bufferState, lexer);
-    yylex_destroy(lexer);
     ParseFree(parser, free);
     return -1;
 }
 
 int no_exit = 1;
+int shell_debug = 0;
+
+/* Command line waiting for the body of its here-document */
+char *pending_line = NULL;
+char *here_delim = NULL;
+char *here_body = NULL;
+size_t here_len = 0, here_size = 0;
+
+/* Append a line and its newline to the here-document body */
+void here_body_append(const char *line)
+{
+    size_t len = strlen(line);
+    if(here_len + len + 2 > here_size) {
+        size_t size = here_size ? here_size : 256;
+        char *body;
+        while(here_len + len + 2 > size) size *= 2;
+        body = realloc(here_body, size);
+        if(!body) {
+            log_err("Out of memory.");
+            return;
+        }
+        here_body = body;
+        here_size = size;
+    }
+    memcpy(here_body + here_len, line, len);
+    here_len += len;
+    here_body[here_len++] = '\n';
+    here_body[here_len] = '\0';
+}
+
+/* Run the pending command with the here-document collected so far */
+void finish_here_document()
+{
+    parse(pending_line, here_body ? here_body : "", NULL, shell_debug);
+    free(pending_line);
+    free(here_delim);
+    free(here_body);
+    pending_line = here_delim = here_body = NULL;
+    here_len = here_size = 0;
+}
+
+/* Called by readline with each complete line, or NULL at end of input */
+void handle_line(char *commandLine)
+{
+    if(!commandLine) {
+        if(pending_line) {
+            fprintf(stderr, "warning: here-document delimited by end-of-file (wanted `%s')\n",
+                        here_delim);
+            finish_here_document();
+        }
+        rl_callback_handler_remove();
+        no_exit = 0;
+        return;
+    }
+
+    if(pending_line) {
+        // Lines up to the delimiter form the body of the here-document
+        if(strcmp(commandLine, here_delim) != 0) {
+            here_body_append(commandLine);
+            free(commandLine);
+            return;
+        }
+        free(commandLine);
+        finish_here_document();
+    } else {
+        if(commandLine[0] != 0) add_history(commandLine);
+        if(parse(commandLine, NULL, &here_delim, shell_debug) == 1) {
+            pending_line = commandLine;
+            rl_set_prompt("> ");
+            return;
+        }
+        free(commandLine);
+    }
+    do_job_notification();
+    // The command may have switched branch without changing directory
+    prompt_refresh_branch();
+    // Readline redisplays this prompt once the handler returns
+    rl_set_prompt(prompt_string());
+}
 
 void catch_interrupt(int signum) {
     printf("\n");
@@ -256,23 +351,25 @@ void catch_interrupt(int signum) {
 
 void print_usage(char *argv[])
 {
-    fprintf(stderr,"Usage: %s [-dh]\n",argv[0]);
+    fprintf(stderr,"Usage: %s [-dhs]\n",argv[0]);
     exit(0);
 }
 
 int main(int argc, char *argv[])
 {
-    int debug = 0;
     int opt;
-    while((opt = getopt(argc,argv,"dh")) != -1){
+    while((opt = getopt(argc,argv,"dhs")) != -1){
         switch(opt) {
             case 'd':
-                debug = 1;
+                shell_debug = 1;
                 printf("Running in debug mode.\n");
                 break;
             case 'h':
                 print_usage(argv);
                 break;
+            case 's':
+                fast_tokenizer = 1;
+                break;
             default:
                 print_usage(argv);
                 break;
@@ -280,19 +377,39 @@ int main(int argc, char *argv[])
     }
 
     init_shell();
-    first_job = new_job();
-    current_job = first_job;
-    char *commandLine;
-
+    if(init_prompt(getenv("JSH_PROMPT")) < 0) exit(1);
 
     signal(SIGINT, catch_interrupt);
 
-    print_cwd();
-    while( no_exit == 1 && (commandLine = readline("$ "))) {
-        if(commandLine[0] != 0) add_history(commandLine);
-        parse(commandLine, debug);        
-        print_cwd();
+    /* Input, prompt updates and captured job output are multiplexed so that
+     *  background prompt segments can redraw the line without waiting for a
+     *  keypress, and captured jobs never block on a full pipe.
+     */
+    rl_callback_handler_install(prompt_string(), handle_line);
+    while(no_exit == 1) {
+        fd_set fds;
+        int max_fd;
+        FD_ZERO(&fds);
+        FD_SET(STDIN_FILENO, &fds);
+        FD_SET(prompt_fd(), &fds);
+        max_fd = capture_fd_set(&fds, prompt_fd());
+        if(select(max_fd + 1, &fds, NULL, NULL, NULL) < 0) {
+            if(errno == EINTR) continue;
+            perror("select");
+            break;
+        }
+        if(FD_ISSET(prompt_fd(), &fds)) {
+            prompt_drain();
+            const char *prompt = prompt_string();
+            if(!pending_line && (!rl_prompt || strcmp(prompt, rl_prompt) != 0)) {
+                rl_set_prompt(prompt);
+                rl_forced_update_display();
+            }
+        }
+        drain_captured_output(&fds);
+        if(FD_ISSET(STDIN_FILENO, &fds)) rl_callback_read_char();
     }
+    if(no_exit == 1) rl_callback_handler_remove();
 
     clear_history();
     return 0;
@@ -3,19 +3,25 @@
    
    start       -> jobSetIn
                -> jobSetIn BACKGROUND
+               -> jobSetIn BACKGROUND_CAPTURE
                -> 
    jobSetIn    -> jobSetOut REDIRECT_IN FILENAME
+               -> jobSetOut HERE_STRING argument
+               -> jobSetOut HERE_DOC
                -> jobSetOut
    jobSetOut   -> commandList REDIRECT_OUT FILENAME
                -> commandList
-   commandList -> command PIPE commandList
+   commandList -> commandList PIPE command
                -> command
    command     -> FILENAME argumentList
                -> FILENAME
-   argumentList-> argument argumentList
+   argumentList-> argumentList argument
                -> argument
    argument    -> ARGUMENT
                -> FILENAME
+
+  Lists are left-recursive so that the parser stack depth does not grow
+  with the number of arguments or pipeline stages.
 */
 
 %include
@@ -34,6 +40,12 @@ printf("Syntax Error\n");
 *valid = 0;
 }
 
+%stack_overflow
+{
+printf("Parser stack overflow\n");
+*valid = 0;
+}
+
 start ::= .
 {
 }
@@ -43,10 +55,19 @@ start ::= jobSetIn .
 start ::= jobSetIn BACKGROUND .
 {
 }
+start ::= jobSetIn BACKGROUND_CAPTURE .
+{
+}
 
 jobSetIn ::= jobSetOut REDIRECT_IN FILENAME .
 {
 }
+jobSetIn ::= jobSetOut HERE_STRING argument .
+{
+}
+jobSetIn ::= jobSetOut HERE_DOC .
+{
+}
 jobSetIn ::= jobSetOut .
 {
 }
@@ -58,7 +79,7 @@ jobSetOut ::= commandList .
 {
 }
 
-commandList ::= command PIPE commandList .
+commandList ::= commandList PIPE command .
 {
 }
 commandList ::= command .
@@ -72,7 +93,7 @@ command ::= FILENAME .
 {
 }
 
-argumentList ::= argument argumentList .
+argumentList ::= argumentList argument .
 {
 }
 argumentList ::= argument .
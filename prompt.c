@@ -0,0 +1,283 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include "job.h"
+#include "prompt.h"
+
+extern job *first_job;
+
+int job_is_completed(job *j);
+int job_is_stopped(job *j);
+
+/* Prompt state owned by the shell thread */
+static char *prompt_template = NULL;
+static char *cwd = NULL;
+static int last_status = 0;
+static char *prompt_buf = NULL;
+static size_t prompt_size = 0;
+static int waited_generation = -1;
+
+/* Branch lookups shared with the worker thread, guarded by lock */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t request_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t result_cond = PTHREAD_COND_INITIALIZER;
+static char *request_dir = NULL;    // Directory waiting to be looked up
+static int generation = 0;          // Bumped whenever a lookup is queued
+static int result_generation = -1;  // Generation the branch belongs to
+static char *branch = NULL;         // Branch of the cwd, NULL if none
+
+/* Written by the worker when a result arrives, read by the event loop */
+static int notify_pipe[2] = { -1, -1 };
+
+/* Read the branch name, or the abbreviated commit when detached, from
+ *  the HEAD file at path. Returns a newly allocated name or NULL.
+ */
+static char *read_head(const char *path)
+{
+    char head[256];
+    char *name = NULL;
+    FILE *f = fopen(path, "r");
+
+    if(!f) return NULL;
+    if(fgets(head, sizeof(head), f)) {
+        head[strcspn(head, "\n")] = '\0';
+        if(strncmp(head, "ref: refs/heads/", 16) == 0) name = strdup(head + 16);
+        else if(head[0]) name = strndup(head, 7);
+    }
+    fclose(f);
+    return name;
+}
+
+/* Returns the branch of the repository containing dir, or NULL */
+static char *find_branch(const char *dir)
+{
+    size_t len = strlen(dir);
+    char *path = malloc(len + sizeof("/.git/HEAD"));
+    char *name = NULL;
+
+    if(!path) return NULL;
+    memcpy(path, dir, len);
+    for(;;) {
+        strcpy(path + len, "/.git/HEAD");
+        if((name = read_head(path)) || len == 0) break;
+        /* Move up to the parent directory */
+        while(len > 0 && path[len - 1] != '/') len--;
+        if(len > 0) len--;
+    }
+    free(path);
+    return name;
+}
+
+/* Worker thread - Looks up branches off the input path */
+static void *prompt_worker(void *arg)
+{
+    char *dir, *name;
+    int gen;
+
+    pthread_mutex_lock(&lock);
+    for(;;) {
+        while(!request_dir) pthread_cond_wait(&request_cond, &lock);
+        dir = request_dir;
+        gen = generation;
+        request_dir = NULL;
+        pthread_mutex_unlock(&lock);
+
+        /* This may block on a slow filesystem, the shell carries on without it */
+        name = find_branch(dir);
+        free(dir);
+
+        pthread_mutex_lock(&lock);
+        if(gen == generation) {
+            free(branch);
+            branch = name;
+            result_generation = gen;
+            pthread_cond_broadcast(&result_cond);
+            if(write(notify_pipe[1], "", 1) < 0 && errno != EAGAIN) {
+                perror("write (prompt)");
+            }
+        } else free(name);
+    }
+    return NULL;
+}
+
+/* Start the prompt engine with the given template.
+ *  Returns 0 on success and -1 if the worker could not be started.
+ */
+int init_prompt(const char *template)
+{
+    pthread_t worker;
+    sigset_t all_signals, saved_mask;
+    int started;
+
+    prompt_template = strdup(template ? template : DEFAULT_PROMPT);
+    if(!prompt_template) return -1;
+
+    if(pipe(notify_pipe) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    fcntl(notify_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(notify_pipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(notify_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(notify_pipe[1], F_SETFD, FD_CLOEXEC);
+
+    /* The worker inherits a mask blocking every signal, so handlers for
+     *  SIGINT and SIGCHLD always run on the shell thread
+     */
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &saved_mask);
+    started = pthread_create(&worker, NULL, prompt_worker, NULL);
+    pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+    if(started != 0) {
+        fprintf(stderr, "Failed to start prompt worker.\n");
+        return -1;
+    }
+    pthread_detach(worker);
+
+    prompt_cwd_changed();
+    return 0;
+}
+
+/* Queue a branch lookup of the cached cwd under a new generation.
+ *  Called with lock held.
+ */
+static void queue_branch_lookup()
+{
+    free(request_dir);
+    request_dir = strdup(cwd);
+    generation++;
+    pthread_cond_signal(&request_cond);
+}
+
+/* Refresh the cached cwd and queue a branch lookup for it.
+ *  Called at startup and by cd; nothing else touches the cwd cache.
+ */
+void prompt_cwd_changed()
+{
+    char *dir = getcwd(NULL, 0);
+    if(!dir) return;
+    free(cwd);
+    cwd = dir;
+
+    pthread_mutex_lock(&lock);
+    queue_branch_lookup();
+    free(branch);
+    branch = NULL;
+    pthread_mutex_unlock(&lock);
+}
+
+/* Queue a branch lookup for the unchanged cwd after a command, which may
+ *  have switched or created a branch. The branch shown so far stays until
+ *  the lookup replaces it.
+ */
+void prompt_refresh_branch()
+{
+    if(!cwd) return;
+    pthread_mutex_lock(&lock);
+    queue_branch_lookup();
+    pthread_mutex_unlock(&lock);
+}
+
+void prompt_set_status(int status)
+{
+    last_status = status;
+}
+
+/* Returns the fd that becomes readable when a background segment changes */
+int prompt_fd()
+{
+    return notify_pipe[0];
+}
+
+/* Consume pending update notifications */
+void prompt_drain()
+{
+    char buf[64];
+    while(read(notify_pipe[0], buf, sizeof(buf)) > 0);
+}
+
+/* Append n characters of s to the prompt buffer at *len */
+static void prompt_append(size_t *len, const char *s, size_t n)
+{
+    if(*len + n + 1 > prompt_size) {
+        size_t size = prompt_size ? prompt_size : 64;
+        char *buf;
+        while(*len + n + 1 > size) size *= 2;
+        if(!(buf = realloc(prompt_buf, size))) return;
+        prompt_buf = buf;
+        prompt_size = size;
+    }
+    memcpy(prompt_buf + *len, s, n);
+    *len += n;
+    prompt_buf[*len] = '\0';
+}
+
+/* Expand the prompt template.
+ *  The first expansion after a lookup is queued waits up to
+ *  PROMPT_BUDGET_MS for the branch; after that the prompt is drawn with
+ *  whatever is known and is redrawn from the event loop once the worker
+ *  catches up.
+ */
+const char *prompt_string()
+{
+    const char *t;
+    char num[32];
+    size_t len = 0;
+    job *j;
+    int count;
+
+    pthread_mutex_lock(&lock);
+    if(waited_generation != generation && result_generation != generation) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += PROMPT_BUDGET_MS * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while(result_generation != generation) {
+            if(pthread_cond_timedwait(&result_cond, &lock, &deadline) != 0) break;
+        }
+    }
+    waited_generation = generation;
+
+    prompt_append(&len, "", 0);
+    for(t = prompt_template; *t; t++) {
+        if(*t != '%' || !t[1]) {
+            prompt_append(&len, t, 1);
+            continue;
+        }
+        switch(*++t) {
+            case 'w':
+                if(cwd) prompt_append(&len, cwd, strlen(cwd));
+                break;
+            case '?':
+                snprintf(num, sizeof(num), "%d", last_status);
+                prompt_append(&len, num, strlen(num));
+                break;
+            case 'j':
+                count = 0;
+                for(j = first_job; j; j = j->next) {
+                    if(!job_is_completed(j) && !job_is_stopped(j)) count++;
+                }
+                snprintf(num, sizeof(num), "%d", count);
+                prompt_append(&len, num, strlen(num));
+                break;
+            case 'b':
+                if(branch) prompt_append(&len, branch, strlen(branch));
+                break;
+            default:
+                prompt_append(&len, t, 1);
+                break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return prompt_buf ? prompt_buf : "$ ";
+}
@@ -0,0 +1,31 @@
+#ifndef _prompt_h
+#define _prompt_h
+
+/* Prompt templates expand the following segments:
+ *  %w  current working directory, cached and updated by cd
+ *  %?  exit status of the last foreground command
+ *  %j  number of running jobs, not counting stopped or finished ones
+ *  %b  VCS branch of the working directory, looked up in the background
+ *      after cd and after every command
+ *  %%  a literal %
+ */
+#define DEFAULT_PROMPT "%w$ "
+
+/* Longest the prompt waits for a background segment before drawing without it */
+#define PROMPT_BUDGET_MS 10
+
+int init_prompt(const char *template);
+
+const char *prompt_string();
+
+void prompt_cwd_changed();
+
+void prompt_refresh_branch();
+
+void prompt_set_status(int status);
+
+int prompt_fd();
+
+void prompt_drain();
+
+#endif
@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "ring.h"
+
+/* Create a ring of size bytes.
+ *  The buffer is an anonymous mapping, so pages are only committed as
+ *  output is written into them. Returns NULL on failure.
+ */
+ring *ring_new(size_t size)
+{
+    ring *r = malloc(sizeof(ring));
+    if(!r) return NULL;
+    r->data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(r->data == MAP_FAILED) {
+        free(r);
+        return NULL;
+    }
+    r->size = size;
+    r->head = 0;
+    return r;
+}
+
+void ring_free(ring *r)
+{
+    munmap(r->data, r->size);
+    free(r);
+}
+
+/* Returns the offset of the oldest byte still held in the ring */
+unsigned long long ring_oldest(ring *r)
+{
+    return r->head > r->size ? r->head - r->size : 0;
+}
+
+/* Read from fd straight into the ring until it would block.
+ *  At most one ring's worth is read per call so a chatty writer cannot
+ *  starve the caller.
+ *  Returns 0 at end of file, 1 if more may follow and -1 on error.
+ */
+int ring_fill(ring *r, int fd)
+{
+    size_t total = 0;
+    while(total < r->size) {
+        size_t off = r->head % r->size;
+        ssize_t n = read(fd, r->data + off, r->size - off);
+        if(n > 0) {
+            r->head += n;
+            total += n;
+        } else if(n == 0) return 0;
+        else if(errno == EINTR) continue;
+        else if(errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+        else return -1;
+    }
+    return 1;
+}
+
+/* Returns the offset of the start of the last lines lines in the ring */
+unsigned long long ring_tail(ring *r, int lines)
+{
+    unsigned long long oldest = ring_oldest(r);
+    unsigned long long pos = r->head;
+
+    /* A trailing newline ends the last line rather than starting a new one */
+    if(pos > oldest && r->data[(pos - 1) % r->size] == '\n') pos--;
+    while(pos > oldest) {
+        if(r->data[(pos - 1) % r->size] == '\n' && --lines <= 0) break;
+        pos--;
+    }
+    return pos;
+}
+
+/* Write the bytes from offset from to the end of the ring to fd.
+ *  Bytes that have already been overwritten are skipped.
+ *  Returns the offset to continue from.
+ */
+unsigned long long ring_write_out(ring *r, unsigned long long from, int fd)
+{
+    unsigned long long oldest = ring_oldest(r);
+    if(from < oldest) from = oldest;
+    while(from < r->head) {
+        size_t off = from % r->size;
+        size_t len = r->size - off;
+        ssize_t n;
+        if(len > r->head - from) len = r->head - from;
+        n = write(fd, r->data + off, len);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            break;
+        }
+        from += n;
+    }
+    return from;
+}
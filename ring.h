@@ -0,0 +1,29 @@
+#ifndef _ring_h
+#define _ring_h
+
+#include <stddef.h>
+
+/* Ring structure - A bounded, memory-mapped byte buffer.
+ *  Offsets are absolute byte counts since the ring was created; once more
+ *  than size bytes have been written the oldest are overwritten.
+ */
+typedef struct ring ring;
+struct ring {
+    char *data;                     // Mapped buffer
+    size_t size;                    // Capacity in bytes
+    unsigned long long head;        // Total bytes ever written
+};
+
+ring *ring_new(size_t size);
+
+void ring_free(ring *r);
+
+unsigned long long ring_oldest(ring *r);
+
+int ring_fill(ring *r, int fd);
+
+unsigned long long ring_tail(ring *r, int lines);
+
+unsigned long long ring_write_out(ring *r, unsigned long long from, int fd);
+
+#endif
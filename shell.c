@@ -1,14 +1,33 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/select.h>
 #include <stdlib.h>
 #include <wait.h>
 #include <error.h>
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <termios.h>
 #include "job.h"
 
+/* Bytes of output kept for each job launched with &! */
+#define CAPTURE_RING_SIZE (1 << 18)
+
+/* Longest single argument or environment string Linux accepts, in pages
+ *  (MAX_ARG_STRLEN), whatever the total ARG_MAX allows
+ */
+#define ARG_STRLEN_PAGES 32
+
+/* Finished &! jobs kept until their output is read with jobs -o.
+ *  Past this many the oldest is released, with a notice, so unread output
+ *  holds at most CAPTURE_RETAINED * CAPTURE_RING_SIZE bytes.
+ */
+#define CAPTURE_RETAINED 8
+
 /* Shell attributes */
 pid_t shell_pgid;
 struct termios shell_tmodes;
@@ -16,27 +35,51 @@ int shell_terminal;
 int shell_is_interactive;
 job *first_job = NULL;
 
-/* Frees the job j if it is in the job list */
+/* Written by the SIGCHLD handler so wait_for_job can select on it */
+static int sigchld_pipe[2] = { -1, -1 };
+
+extern char **environ;
+
+int job_is_completed(job *j);
+int capture_fd_set(fd_set *fds, int max_fd);
+void drain_captured_output(fd_set *fds);
+
+/* Frees the job j, terminating any of its processes that are still running */
 void free_job(job *j)
 {
     /* Terminate all processes */
-    if(kill(- j->pgid, SIGTERM) > 0) {
+    if(j->pgid && !job_is_completed(j) && kill(- j->pgid, SIGTERM) < 0) {
         perror("kill (SIGTERM)");
     }
 
-    free(j);
+    delete_job(j);
 }
 
-void free_process(process *p)
+/* Append the job j to the active job list, numbering it after the last job */
+void add_job(job *j)
 {
-
-    // Kill the process
-    if(kill(- p->pid, SIGTERM) > 0) {
-        perror("kill (SIGTERM)");
+    job **last;
+    int id = 0;
+    for(last = &first_job; *last; last = &(*last)->next) {
+        if((*last)->id > id) id = (*last)->id;
     }
+    j->id = id + 1;
+    *last = j;
+}
 
-    free(p);
+/* Remove the job j from the active job list and free it */
+void remove_job(job *j)
+{
+    job **last;
+    for(last = &first_job; *last; last = &(*last)->next) {
+        if(*last == j) {
+            *last = j->next;
+            break;
+        }
+    }
+    free_job(j);
 }
+
 /* Find active job with the given pgid */
 job *find_job(pid_t pgid)
 {
@@ -48,6 +91,16 @@ job *find_job(pid_t pgid)
     return NULL;
 }
 
+/* Find active job with the given job number */
+job *find_job_id(int id)
+{
+    job *j;
+    for(j = first_job; j; j = j->next) {
+        if(j->id == id) return j;
+    }
+    return NULL;
+}
+
 /* Returns 1 iff all processes in the given job are stopped */
 int job_is_stopped(job *j)
 {
@@ -70,6 +123,17 @@ int job_is_completed(job *j)
     return 1;
 }
 
+/* Returns the exit status of the last process in the job.
+ *  Processes killed by a signal report 128 plus the signal number.
+ */
+int job_exit_status(job *j)
+{
+    process *p;
+    for(p = j->first_process; p->next; p = p->next);
+    if(WIFSIGNALED(p->status)) return 128 + WTERMSIG(p->status);
+    return WEXITSTATUS(p->status);
+}
+
 /* Send a signal to a job */
 void job_send_signal(job *j, int signal)
 {
@@ -126,22 +190,42 @@ void update_status()
 
 /* Check for processes that have status info available,
  *  blocking until all processes in the given job have reported.
+ *  Captured output of background jobs keeps being drained meanwhile, so
+ *  they do not stall on a full pipe while a foreground job runs.
  */
 void wait_for_job(job *j)
 {
-    int status;
+    int status, max_fd;
     pid_t pid;
-
-    do pid = waitpid(WAIT_ANY, &status, WUNTRACED);
-    while(!mark_process_status(pid,status) 
-            && !job_is_stopped(j)
-            && !job_is_completed(j));
+    fd_set fds;
+    char buf[64];
+
+    for(;;) {
+        do pid = waitpid(WAIT_ANY, &status, WUNTRACED|WNOHANG);
+        while(!mark_process_status(pid, status));
+        if(job_is_stopped(j) || job_is_completed(j)) break;
+        if(pid < 0 && errno == ECHILD) break;
+
+        /* Sleep until a child changes state or captured output arrives */
+        FD_ZERO(&fds);
+        FD_SET(sigchld_pipe[0], &fds);
+        max_fd = capture_fd_set(&fds, sigchld_pipe[0]);
+        if(select(max_fd + 1, &fds, NULL, NULL, NULL) < 0) {
+            if(errno == EINTR) continue;
+            perror("select");
+            break;
+        }
+        if(FD_ISSET(sigchld_pipe[0], &fds)) {
+            while(read(sigchld_pipe[0], buf, sizeof(buf)) > 0);
+        }
+        drain_captured_output(&fds);
+    }
 }
 
 /* Format information about the job for display to user */
 void format_job_info(job *j, const char *status)
 {
-    fprintf(stderr, "%ld (%s): %s\n", (long)j->pgid, status, j->command);
+    fprintf(stderr, "[%d] %ld (%s): %s\n", j->id, (long)j->pgid, status, j->command);
 }
 
 /* Puts the job j in the foreground.
@@ -186,13 +270,50 @@ void put_job_in_background(job *j, int cont)
 }
 
 
+/* Read whatever output is waiting on the capture pipe of j into its ring.
+ *  The pipe is closed once every writer has gone.
+ */
+void drain_job_output(job *j)
+{
+    if(j->output_fd < 0) return;
+    if(ring_fill(j->output, j->output_fd) <= 0) {
+        close(j->output_fd);
+        j->output_fd = -1;
+    }
+}
+
+/* Add the open capture pipes to fds for the event loop.
+ *  Returns the highest fd in the set given the previous highest max_fd.
+ */
+int capture_fd_set(fd_set *fds, int max_fd)
+{
+    job *j;
+    for(j = first_job; j; j = j->next) {
+        if(j->output_fd < 0) continue;
+        FD_SET(j->output_fd, fds);
+        if(j->output_fd > max_fd) max_fd = j->output_fd;
+    }
+    return max_fd;
+}
+
+/* Drain the capture pipes that select reported as readable */
+void drain_captured_output(fd_set *fds)
+{
+    job *j;
+    for(j = first_job; j; j = j->next) {
+        if(j->output_fd >= 0 && FD_ISSET(j->output_fd, fds)) drain_job_output(j);
+    }
+}
+
 /* Notify user about stopped or terminated jobs.
- *  Delete terminated jobs from active joblist.
+ *  Delete terminated jobs from active joblist. Captured jobs stay until
+ *  their output is read, up to CAPTURE_RETAINED of them.
  */
 void do_job_notification()
 {
     job *j, *jlast, *jnext;
     process *p;
+    int retained;
 
     /* Update status info for child processes */
     update_status();
@@ -203,7 +324,16 @@ void do_job_notification()
         /* If all process are complete, inform the user the job is complete
          *  and remove it from the active list 
          */
-        if(job_is_completed(j)) {
+        if(job_is_completed(j) && j->output) {
+            /* Captured output is kept until it is read with jobs -o */
+            drain_job_output(j);
+            if(!j->notified) {
+                j->notified = 1;
+                format_job_info(j, "completed");
+            }
+            jlast = j;
+        }
+        else if(job_is_completed(j)) {
             format_job_info(j, "completed");
             if(jlast) jlast->next = jnext;
             else first_job = jnext;
@@ -220,6 +350,20 @@ void do_job_notification()
         }
 
     }
+
+    /* Release the oldest finished captured jobs beyond the limit */
+    retained = 0;
+    for(j = first_job; j; j = j->next) {
+        if(job_is_completed(j) && j->output) retained++;
+    }
+    for(j = first_job; j && retained > CAPTURE_RETAINED; j = jnext) {
+        jnext = j->next;
+        if(job_is_completed(j) && j->output) {
+            fprintf(stderr, "[%d] output of %s discarded unread\n", j->id, j->command);
+            remove_job(j);
+            retained--;
+        }
+    }
 }
 
 /* Notify user about all running jobs. */
@@ -257,8 +401,20 @@ void continue_job(job *j, int foreground)
     else put_job_in_background(j, 1);
 }
 
+/* Wake wait_for_job when a child changes state */
+static void catch_sigchld(int signum)
+{
+    int saved_errno = errno;
+    if(write(sigchld_pipe[1], "", 1) < 0) {
+        // The pipe is full, so a wakeup is already pending
+    }
+    errno = saved_errno;
+}
+
 void init_shell()
 {
+    struct sigaction action;
+
     /* Ensure that shell is interactive */
     shell_terminal = STDIN_FILENO;
     shell_is_interactive = isatty(shell_terminal);
@@ -278,7 +434,6 @@ void init_shell()
         signal(SIGTSTP, SIG_IGN);
         signal(SIGTTIN, SIG_IGN);
         signal(SIGTTOU, SIG_IGN);
-        signal(SIGCHLD, SIG_IGN);
 
         /* Put shell into its own proc group */
         shell_pgid = getpid();
@@ -293,6 +448,53 @@ void init_shell()
         /* Save the default terminal attributes */
         tcgetattr(shell_terminal, &shell_tmodes);
     }
+
+    if(pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = catch_sigchld;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &action, NULL);
+}
+
+/* Returns a sealed, rewound memfd holding the len bytes of text, for use as
+ *  the stdin of a here-string or here-document, or -1 on failure.
+ *  The contents live in memory, so they never touch disk and a large body
+ *  never blocks on a pipe buffer.
+ */
+int open_here_document(const char *text, size_t len)
+{
+    ssize_t n;
+    int fd = memfd_create("jsh-here-document", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(fd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+
+    while(len > 0) {
+        n = write(fd, text, len);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            perror("write (here-document)");
+            close(fd);
+            return -1;
+        }
+        text += n;
+        len -= n;
+    }
+
+    if(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        perror("fcntl (F_ADD_SEALS)");
+    }
+    if(lseek(fd, 0, SEEK_SET) < 0) {
+        perror("lseek");
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
 /* Launch a process */
@@ -328,7 +530,7 @@ void launch_process(process *p, pid_t pgid, int infile,
     }
     if(outfile != STDOUT_FILENO) {
         dup2(outfile, STDOUT_FILENO);
-        close(outfile);
+        if(outfile != errfile) close(outfile);
     }
     if(errfile != STDERR_FILENO) {
         dup2(errfile, STDERR_FILENO);
@@ -341,11 +543,90 @@ void launch_process(process *p, pid_t pgid, int infile,
     exit(1);
 }
 
-void launch_job(job *j, int foreground, int debug)
+/* Returns the number of bytes the NULL-terminated vector v occupies
+ *  when passed to exec: the strings plus the pointer array.
+ */
+size_t exec_vector_size(char **v)
+{
+    size_t size = sizeof(char *);
+    for(; v && *v; v++) size += strlen(*v) + 1 + sizeof(char *);
+    return size;
+}
+
+/* Returns the longest string, counting its NUL, in the NULL-terminated v */
+size_t exec_vector_longest(char **v)
+{
+    size_t len, longest = 0;
+    for(; v && *v; v++) {
+        len = strlen(*v) + 1;
+        if(len > longest) longest = len;
+    }
+    return longest;
+}
+
+/* Returns 1 iff the arguments and environment of every process in the job
+ *  fit within ARG_MAX, and no single string exceeds the MAX_ARG_STRLEN
+ *  Linux also enforces, reporting the first process that does not fit.
+ *  Checked before the job is launched so no stage of it is started.
+ */
+int job_fits_arg_max(job *j)
+{
+    process *p;
+    long arg_max = sysconf(_SC_ARG_MAX);
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t env_size = exec_vector_size(environ);
+    size_t env_longest = exec_vector_longest(environ);
+    size_t strlen_max = page_size > 0 ? (size_t)page_size * ARG_STRLEN_PAGES : 0;
+
+    for(p = j->first_process; p; p = p->next) {
+        size_t size = exec_vector_size(p->argv) + env_size;
+        size_t longest = exec_vector_longest(p->argv);
+        if(arg_max > 0 && size > (size_t)arg_max) {
+            fprintf(stderr, "%s: %s (%zu bytes of arguments and environment, limit %ld)\n",
+                        p->argv[0], strerror(E2BIG), size, arg_max);
+            return 0;
+        }
+        if(env_longest > longest) longest = env_longest;
+        if(strlen_max && longest > strlen_max) {
+            fprintf(stderr, "%s: %s (%zu byte %s, limit %zu)\n",
+                        p->argv[0], strerror(E2BIG), longest,
+                        longest == env_longest ? "environment string" : "argument",
+                        strlen_max);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Launch the job j.
+ *  If capture is set and the shell is interactive, the stdout and stderr
+ *  the job would have shared with the terminal go to a pipe instead, which
+ *  the event loop drains into the job's output ring.
+ */
+void launch_job(job *j, int foreground, int capture, int debug)
 {
     process *p;
     pid_t pid;
     int mypipe[2], infile, outfile;
+    int capture_pipe[2] = { -1, -1 };
+    int lastfile = j->stdout;
+    int errfile = j->stderr;
+
+    /* Set up output capture */
+    if(capture && shell_is_interactive) {
+        if(!(j->output = ring_new(CAPTURE_RING_SIZE))) {
+            perror("mmap (capture)");
+        } else if(pipe2(capture_pipe, O_CLOEXEC) < 0) {
+            perror("pipe");
+            ring_free(j->output);
+            j->output = NULL;
+        } else {
+            fcntl(capture_pipe[0], F_SETFL, O_NONBLOCK);
+            j->output_fd = capture_pipe[0];
+            if(lastfile == STDOUT_FILENO) lastfile = capture_pipe[1];
+            if(errfile == STDERR_FILENO) errfile = capture_pipe[1];
+        }
+    }
 
     infile = j->stdin;
     for(p = j->first_process; p; p = p->next) {
@@ -356,13 +637,13 @@ void launch_job(job *j, int foreground, int debug)
                 exit(1);
             }
             outfile = mypipe[1];
-        } else outfile = j->stdout;
+        } else outfile = lastfile;
 
         /* Fork the child process */
         pid = fork();
         if(pid == 0) { 
             /* Child process */
-            launch_process(p, j->pgid, infile, outfile, j->stderr, foreground);
+            launch_process(p, j->pgid, infile, outfile, errfile, foreground);
         } else if(pid < 0) {
             /* Fork failed */
             perror("fork");
@@ -378,9 +659,11 @@ void launch_job(job *j, int foreground, int debug)
 
         /* Cleanup after pipes */
         if(infile != j->stdin) close(infile);
-        if(outfile != j->stdout) close(outfile);
+        if(outfile != j->stdout && outfile != capture_pipe[1]) close(outfile);
         infile = mypipe[0];
     }
+    /* Only the job holds the write end, so the pipe sees EOF when it exits */
+    if(capture_pipe[1] >= 0) close(capture_pipe[1]);
 
     if(debug) format_job_info(j, "launched");
 
@@ -0,0 +1,249 @@
+#include <string.h>
+#include "parser.h"
+#include "tokenizer.h"
+
+/* Hand-written equivalent of the rules in scanner.l.
+ *  Rather than matching one character at a time, runs of FILENAME and
+ *  ARGUMENT characters are measured 16 or 32 bytes at a time with SSE2/AVX2
+ *  and tokens are returned as spans into the original line.
+ */
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define TOKENIZER_SIMD
+#include <immintrin.h>
+#endif
+
+/* Offset recorded while no byte ending a FILENAME run has been seen */
+#define NO_STOP ((size_t)-1)
+
+/* Characters which end an ARGUMENT: [^ \t\r\n|'"($\()\)] */
+static int is_argument_char(char c)
+{
+    switch(c) {
+        case '\0': case ' ': case '\t': case '\r': case '\n':
+        case '|': case '\'': case '"': case '(': case ')': case '$':
+            return 0;
+    }
+    return 1;
+}
+
+/* Characters which make up a FILENAME: [a-zA-Z0-9\.\-_] */
+static int is_filename_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '.' || c == '-' || c == '_';
+}
+
+/* Returns the length of a here-document operator and its delimiter,
+ *  "<<"[ \t]*[a-zA-Z0-9_]+, at the start of s[0..n), or 0 if there is none.
+ */
+static size_t here_doc_length(const char *s, size_t n)
+{
+    size_t i = 2, delim;
+    if(n < 3 || s[0] != '<' || s[1] != '<') return 0;
+    while(i < n && (s[i] == ' ' || s[i] == '\t')) i++;
+    for(delim = i; i < n && (is_filename_char(s[i]) && s[i] != '.' && s[i] != '-'); i++);
+    return i > delim ? i : 0;
+}
+
+#ifdef TOKENIZER_SIMD
+
+/* Byte masks of the characters in a block that end a run.
+ *  Signed comparisons are safe for the ranges since bytes >= 0x80 compare
+ *  as negative and are never FILENAME characters.
+ */
+static unsigned argument_stops_sse2(__m128i v)
+{
+    __m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('|')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('(')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(')')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('$')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    return (unsigned)_mm_movemask_epi8(m);
+}
+
+static __m128i in_range_sse2(__m128i v, char lo, char hi)
+{
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                         _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+static unsigned filename_stops_sse2(__m128i v)
+{
+    __m128i m = in_range_sse2(v, 'a', 'z');
+    m = _mm_or_si128(m, in_range_sse2(v, 'A', 'Z'));
+    m = _mm_or_si128(m, in_range_sse2(v, '0', '9'));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('-')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    return ~(unsigned)_mm_movemask_epi8(m) & 0xffff;
+}
+
+__attribute__((target("avx2")))
+static unsigned argument_stops_avx2(__m256i v)
+{
+    __m256i m = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('|')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('(')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(')')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('$')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+    return (unsigned)_mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2")))
+static __m256i in_range_avx2(__m256i v, char lo, char hi)
+{
+    return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+}
+
+__attribute__((target("avx2")))
+static unsigned filename_stops_avx2(__m256i v)
+{
+    __m256i m = in_range_avx2(v, 'a', 'z');
+    m = _mm256_or_si256(m, in_range_avx2(v, 'A', 'Z'));
+    m = _mm256_or_si256(m, in_range_avx2(v, '0', '9'));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('.')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('-')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+    return ~(unsigned)_mm256_movemask_epi8(m);
+}
+
+/* Scan whole blocks of s[0..n) for the first byte ending an ARGUMENT run.
+ *  Returns its offset, or the offset of the first byte not yet scanned.
+ *  FILENAME characters are a subset of ARGUMENT characters, so the same pass
+ *  records the first byte ending a FILENAME run in *name_len if it is still
+ *  NO_STOP.
+ *  The upper halves of the ymm registers are cleared on every exit: the
+ *  SSE2 code that runs next would otherwise pay an AVX-SSE transition
+ *  penalty per token, which gcc does not avoid for us at -O.
+ */
+__attribute__((target("avx2")))
+static size_t run_blocks_avx2(const char *s, size_t n, size_t *name_len)
+{
+    size_t i;
+    for(i = 0; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        unsigned stops = argument_stops_avx2(v);
+        if(*name_len == NO_STOP) {
+            unsigned name_stops = filename_stops_avx2(v);
+            if(name_stops) *name_len = i + __builtin_ctz(name_stops);
+        }
+        if(stops) {
+            _mm256_zeroupper();
+            return i + __builtin_ctz(stops);
+        }
+    }
+    _mm256_zeroupper();
+    return i;
+}
+
+static size_t run_blocks_sse2(const char *s, size_t n, size_t *name_len)
+{
+    size_t i;
+    for(i = 0; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        unsigned stops = argument_stops_sse2(v);
+        if(*name_len == NO_STOP) {
+            unsigned name_stops = filename_stops_sse2(v);
+            if(name_stops) *name_len = i + __builtin_ctz(name_stops);
+        }
+        if(stops) return i + __builtin_ctz(stops);
+    }
+    return i;
+}
+
+static int have_avx2 = -1;
+
+#endif
+
+/* Returns the length of the run of ARGUMENT characters at the start of
+ *  s[0..n), and sets *name_len to the length of the run of FILENAME
+ *  characters it begins with.
+ */
+static size_t run_length(const char *s, size_t n, size_t *name_len)
+{
+    size_t i = 0, name = NO_STOP;
+#ifdef TOKENIZER_SIMD
+    if(have_avx2 < 0) have_avx2 = __builtin_cpu_supports("avx2");
+    if(have_avx2) i = run_blocks_avx2(s, n, &name);
+    /* Only the tail of a run is left to the SSE2 blocks */
+    if(i + 16 <= n && is_argument_char(s[i])) {
+        size_t base = i, rest = name;
+        i += run_blocks_sse2(s + base, n - base, &rest);
+        if(name == NO_STOP && rest != NO_STOP) name = base + rest;
+    }
+#endif
+    for(; i < n && is_argument_char(s[i]); i++) {
+        if(name == NO_STOP && !is_filename_char(s[i])) name = i;
+    }
+    *name_len = name == NO_STOP ? i : name;
+    return i;
+}
+
+void tokenizer_init(tokenizer *t, const char *line)
+{
+    t->line = line;
+    t->length = strlen(line);
+    t->pos = 0;
+}
+
+/* Scan the next token into span.
+ *  Returns the token code, or 0 at the end of the line.
+ */
+int tokenizer_next(tokenizer *t, token_span *span)
+{
+    const char *s = t->line;
+    size_t start, arg_len, name_len, doc_len;
+
+    while(t->pos < t->length) {
+        start = t->pos;
+        arg_len = run_length(s + start, t->length - start, &name_len);
+
+        if(arg_len == 0) {
+            t->pos++;
+            if(s[start] == '|') {
+                span->type = PIPE;
+                span->offset = start;
+                span->length = 1;
+                return PIPE;
+            }
+            /* Whitespace, quotes, parentheses and '$' are discarded */
+            continue;
+        }
+
+        /* Flex takes the longest match, breaking ties by rule order */
+        span->offset = start;
+        span->length = arg_len;
+        if(arg_len == 1 && s[start] == '&') span->type = BACKGROUND;
+        else if(arg_len == 2 && s[start] == '&' && s[start + 1] == '!') span->type = BACKGROUND_CAPTURE;
+        else if(arg_len == 1 && s[start] == '<') span->type = REDIRECT_IN;
+        else if(arg_len == 1 && s[start] == '>') span->type = REDIRECT_OUT;
+        else if(arg_len == 3 && strncmp(s + start, "<<<", 3) == 0) span->type = HERE_STRING;
+        else if((doc_len = here_doc_length(s + start, t->length - start)) >= arg_len) {
+            span->type = HERE_DOC;
+            span->length = doc_len;
+        } else {
+            span->type = name_len == arg_len ? FILENAME : ARGUMENT;
+        }
+        t->pos = start + span->length;
+        return span->type;
+    }
+
+    span->type = 0;
+    span->offset = t->length;
+    span->length = 0;
+    return 0;
+}
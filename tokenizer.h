@@ -0,0 +1,26 @@
+#ifndef _tokenizer_h
+#define _tokenizer_h
+
+#include <stddef.h>
+
+/* Token span - A single token as a slice of the command line */
+typedef struct token_span token_span;
+struct token_span {
+    int type;                       // Token code from parser.h, 0 at end of line
+    size_t offset;                  // Offset of the first byte in the line
+    size_t length;                  // Length of the token in bytes
+};
+
+/* Tokenizer structure - Position within a single command line */
+typedef struct tokenizer tokenizer;
+struct tokenizer {
+    const char *line;               // Command line being scanned
+    size_t length;                  // Length of the command line
+    size_t pos;                     // Offset of the next unscanned byte
+};
+
+void tokenizer_init(tokenizer *t, const char *line);
+
+int tokenizer_next(tokenizer *t, token_span *span);
+
+#endif
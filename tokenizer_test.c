@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "parser.h"
+#include "scanner.yy.h"
+#include "tokenizer.h"
+
+/* Differential test and benchmark of the vectorized tokenizer against the
+ *  flex scanner it replaces.
+ *   tokenizer_test        compare the token streams over generated lines
+ *   tokenizer_test -b     print the throughput of both scanners in MB/s
+ */
+
+#define TEST_LINES 200000
+#define TEST_LINE_MAX 160
+#define LONG_LINES 100000
+#define LONG_LINE_MAX 512
+#define LONG_RUN_MIN 17
+#define LONG_RUN_MAX 100
+#define BENCH_SIZE (16 << 20)
+#define BENCH_RUNS 10
+
+/* Fragments lines are built from, chosen to hit every rule and tie */
+static const char *fragments[] = {
+    "ls", "-la", "file.txt", "a_b-c.d", "x", "42", "/usr/bin", "a=b", "*.c",
+    "|", "&", "&!", "&&", "!", "<", ">", "<<", "<<<", "<<EOF", "<< EOF",
+    "<<\tEND", "<<-x", "<<.", ">>", "<x", "&x", "'", "\"", "\"quoted arg\"",
+    "'single'", "$(", "$(cmd)", "(", ")", "$", "$HOME", " ", "  ", "\t",
+    "\r", "\n", "\xc3\xa9", "caf\xc3\xa9", "\x80\xff", "~", "#", ";",
+};
+
+#define NUM_FRAGMENTS (sizeof(fragments) / sizeof(fragments[0]))
+
+/* Fill line with up to max bytes of random fragments */
+static void generate_line(char *line, size_t max)
+{
+    size_t len = 0, n;
+    int parts = rand() % 24;
+    line[0] = '\0';
+    while(parts-- > 0) {
+        const char *f = fragments[rand() % NUM_FRAGMENTS];
+        n = strlen(f);
+        if(len + n + 1 >= max) break;
+        memcpy(line + len, f, n);
+        len += n;
+        /* Usually, but not always, separate fragments */
+        if(rand() % 4 && len + 2 < max) line[len++] = ' ';
+        line[len] = '\0';
+    }
+}
+
+/* Bytes of long runs: FILENAME characters, characters that only continue
+ *  an ARGUMENT, and characters that end both
+ */
+static const char filename_chars[] =
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-_";
+static const char argument_chars[] = "=/*~#;!<>&\x80\xc3\xff";
+static const char stop_chars[] = " \t\r\n|'\"()$";
+
+/* Write a run of len FILENAME characters to s, with an ARGUMENT-only
+ *  character at offset arg_at unless arg_at >= len
+ */
+static void fill_run(char *s, size_t len, size_t arg_at)
+{
+    size_t i;
+    for(i = 0; i < len; i++) s[i] = filename_chars[rand() % (sizeof(filename_chars) - 1)];
+    if(arg_at < len) s[arg_at] = argument_chars[rand() % (sizeof(argument_chars) - 1)];
+}
+
+/* Fill line with up to max bytes of runs of LONG_RUN_MIN to LONG_RUN_MAX
+ *  characters, long enough to cross the 16 and 32 byte SIMD blocks
+ */
+static void generate_long_line(char *line, size_t max)
+{
+    size_t len = 0, n;
+    int parts = 1 + rand() % 6;
+    while(parts-- > 0) {
+        n = LONG_RUN_MIN + rand() % (LONG_RUN_MAX - LONG_RUN_MIN + 1);
+        if(len + n + 2 >= max) break;
+        /* Half the runs are ARGUMENTs that stop being FILENAMEs part way */
+        fill_run(line + len, n, rand() % 2 ? rand() % n : n);
+        len += n;
+        line[len++] = stop_chars[rand() % (sizeof(stop_chars) - 1)];
+    }
+    line[len] = '\0';
+}
+
+/* Print a line with unprintable bytes escaped */
+static void print_escaped(const char *s, size_t len)
+{
+    size_t i;
+    for(i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if(c < 0x20 || c >= 0x7f) printf("\\x%02x", c);
+        else putchar(c);
+    }
+}
+
+/* Compare the token streams of both scanners over line.
+ *  Returns 0 if they agree and -1 after reporting the first difference.
+ */
+static int compare_line(const char *line)
+{
+    yyscan_t lexer;
+    YY_BUFFER_STATE buffer;
+    tokenizer tok;
+    token_span span;
+    int flex_code, fast_code, index = 0, ret = 0;
+    const char *flex_text;
+    size_t flex_len;
+
+    yylex_init(&lexer);
+    buffer = yy_scan_string(line, lexer);
+    tokenizer_init(&tok, line);
+
+    do {
+        flex_code = yylex(lexer);
+        flex_text = flex_code ? yyget_text(lexer) : "";
+        flex_len = flex_code ? yyget_leng(lexer) : 0;
+        fast_code = tokenizer_next(&tok, &span);
+
+        if(flex_code != fast_code || flex_len != span.length ||
+                memcmp(flex_text, line + span.offset, flex_len) != 0) {
+            printf("FAIL: token %d of \"", index);
+            print_escaped(line, strlen(line));
+            printf("\"\n  flex:      %d \"", flex_code);
+            print_escaped(flex_text, flex_len);
+            printf("\"\n  tokenizer: %d \"", fast_code);
+            print_escaped(line + span.offset, span.length);
+            printf("\"\n");
+            ret = -1;
+            break;
+        }
+        index++;
+    } while(flex_code > 0);
+
+    yy_delete_buffer(buffer, lexer);
+    yylex_destroy(lexer);
+    return ret;
+}
+
+static int run_check()
+{
+    char line[LONG_LINE_MAX];
+    size_t len, at;
+    int i = 0, failures = 0;
+    const char *stop;
+
+    /* Every run length ends at every offset of a 16 and 32 byte block, on
+     *  every character that can end it, and turns from a FILENAME into an
+     *  ARGUMENT at every offset
+     */
+    for(len = LONG_RUN_MIN; len <= LONG_RUN_MAX && failures < 10; len++) {
+        for(stop = stop_chars; *stop && failures < 10; stop++, i++) {
+            fill_run(line, len, len);
+            line[len] = *stop;
+            fill_run(line + len + 1, len, len);
+            line[2 * len + 1] = '\0';
+            if(compare_line(line) < 0) failures++;
+        }
+        for(at = 0; at < len && failures < 10; at++, i++) {
+            fill_run(line, len, at);
+            line[len] = '\0';
+            if(compare_line(line) < 0) failures++;
+        }
+    }
+
+    for(; i < TEST_LINES && failures < 10; i++) {
+        generate_line(line, TEST_LINE_MAX);
+        if(compare_line(line) < 0) failures++;
+    }
+    for(; i < TEST_LINES + LONG_LINES && failures < 10; i++) {
+        generate_long_line(line, sizeof(line));
+        if(compare_line(line) < 0) failures++;
+    }
+    if(failures) {
+        printf("%d of %d lines differ\n", failures, i);
+        return 1;
+    }
+    printf("ok: %d lines, flex and tokenizer agree\n", i);
+    return 0;
+}
+
+static double elapsed(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int run_bench()
+{
+    char *line = malloc(BENCH_SIZE + 1);
+    size_t len = 0, tokens = 0;
+    struct timespec start;
+    double secs, best = 0;
+    int run;
+    yyscan_t lexer;
+    YY_BUFFER_STATE buffer;
+    tokenizer tok;
+    token_span span;
+
+    if(!line) {
+        perror("malloc");
+        return 1;
+    }
+
+    /* A generated file list, the case the tokenizer exists for */
+    while(len < BENCH_SIZE) {
+        int n = snprintf(line + len, BENCH_SIZE + 1 - len,
+                        "src/module_%d/file-%d.c ", rand() % 1000, rand());
+        if(n <= 0) break;
+        len += n;
+    }
+    line[BENCH_SIZE] = '\0';
+    len = strlen(line);
+
+    /* The fastest of several runs, as a single one is easily disturbed */
+    for(run = 0; run < BENCH_RUNS; run++) {
+        tokens = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        yylex_init(&lexer);
+        buffer = yy_scan_string(line, lexer);
+        while(yylex(lexer) > 0) {
+            tokens++;
+            yyget_text(lexer);
+        }
+        yy_delete_buffer(buffer, lexer);
+        yylex_destroy(lexer);
+        secs = elapsed(&start);
+        if(run == 0 || secs < best) best = secs;
+    }
+    printf("flex:      %zu tokens in %.1f MB, %.0f MB/s\n", tokens, len / 1e6, len / 1e6 / best);
+
+    for(run = 0; run < BENCH_RUNS; run++) {
+        tokens = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        tokenizer_init(&tok, line);
+        while(tokenizer_next(&tok, &span) > 0) tokens++;
+        secs = elapsed(&start);
+        if(run == 0 || secs < best) best = secs;
+    }
+    printf("tokenizer: %zu tokens in %.1f MB, %.0f MB/s\n", tokens, len / 1e6, len / 1e6 / best);
+
+    free(line);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, bench = 0;
+    while((opt = getopt(argc, argv, "b")) != -1) {
+        if(opt == 'b') bench = 1;
+        else {
+            fprintf(stderr, "Usage: %s [-b]\n", argv[0]);
+            return 2;
+        }
+    }
+    srand(1);
+    return bench ? run_bench() : run_check();
+}